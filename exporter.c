@@ -0,0 +1,500 @@
+/*
+ * sfp-driver - SFP driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "exporter.h"
+#include "sfp.h"
+
+#include <libubox/uloop.h>
+#include <libubox/usock.h>
+#include <libubox/utils.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+// Initial size of the rendering buffer. It is only grown when a scrape does
+// not fit, so subsequent scrapes do not allocate.
+#define EXPORTER_BUFFER_SIZE 65536
+// Time after which an idle client is disconnected (in milliseconds).
+#define EXPORTER_CLIENT_TIMEOUT 5000
+// Values are formatted by scaling them by a power of ten until they reach
+// this bound, which gives seven significant digits.
+#define EXPORTER_MANTISSA_MIN 1000000
+// Largest power of ten used for scaling values (supports 18 decimals).
+#define EXPORTER_DECIMALS_MAX 18
+
+#define EXPORTER_HEADER \
+  "HTTP/1.0 200 OK\r\n" \
+  "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n" \
+  "Connection: close\r\n" \
+  "\r\n"
+
+struct exporter_buffer {
+  char *data;
+  size_t size;
+  size_t length;
+  int overflow;
+};
+
+struct exporter_metric {
+  const char *name;
+  const char *help;
+  size_t diagnostics_offset;
+  size_t statistics_offset;
+};
+
+static const struct exporter_metric exporter_metrics[] = {
+  { "temperature_celsius", "Module temperature",
+    offsetof(struct sfp_diagnostics_item, temperature), offsetof(struct sfp_statistics, temperature) },
+  { "vcc_volts", "Module supply voltage",
+    offsetof(struct sfp_diagnostics_item, vcc), offsetof(struct sfp_statistics, vcc) },
+  { "tx_bias_milliamperes", "Laser bias current",
+    offsetof(struct sfp_diagnostics_item, tx_bias), offsetof(struct sfp_statistics, tx_bias) },
+  { "tx_power_milliwatts", "Transmitted optical power",
+    offsetof(struct sfp_diagnostics_item, tx_power), offsetof(struct sfp_statistics, tx_power) },
+  { "rx_power_milliwatts", "Received optical power",
+    offsetof(struct sfp_diagnostics_item, rx_power), offsetof(struct sfp_statistics, rx_power) },
+};
+
+// Listening socket.
+static struct uloop_fd server;
+// Currently served client (clients are served one at a time).
+static struct uloop_fd client;
+// Timer for disconnecting idle clients.
+static struct uloop_timeout timer_client;
+// Rendered response and the amount of it already sent to the client.
+static struct exporter_buffer buffer;
+static size_t client_offset;
+static int client_responding;
+
+void exporter_server_cb(struct uloop_fd *fd, unsigned int events);
+void exporter_client_cb(struct uloop_fd *fd, unsigned int events);
+void exporter_client_timeout(struct uloop_timeout *timeout);
+void exporter_close_client();
+int exporter_render();
+void exporter_render_metrics();
+
+int exporter_init(const char *path)
+{
+  buffer.data = (char*) malloc(EXPORTER_BUFFER_SIZE);
+  if (!buffer.data) {
+    return -1;
+  }
+  buffer.size = EXPORTER_BUFFER_SIZE;
+
+  // Remove any stale socket left behind by a previous instance.
+  unlink(path);
+
+  server.fd = usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, path, NULL);
+  if (server.fd < 0) {
+    syslog(LOG_ERR, "Failed to create metrics exporter socket '%s'.", path);
+    return -1;
+  }
+
+  server.cb = exporter_server_cb;
+  client.fd = -1;
+  client.cb = exporter_client_cb;
+  timer_client.cb = exporter_client_timeout;
+  uloop_fd_add(&server, ULOOP_READ);
+
+  syslog(LOG_INFO, "Serving metrics on '%s'.", path);
+  return 0;
+}
+
+void exporter_server_cb(struct uloop_fd *fd, unsigned int events)
+{
+  // Clients are served one at a time, as they share the rendering buffer. A
+  // response being sent is completed first, new connections wait until then.
+  if (client.fd >= 0 && client_responding) {
+    uloop_fd_delete(&server);
+    return;
+  }
+
+  int client_fd = accept(fd->fd, NULL, NULL);
+  if (client_fd < 0) {
+    return;
+  }
+
+  fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+  // A client which has not sent its request yet is replaced, so a client which
+  // connects and never sends one does not hold up other scrapes.
+  if (client.fd >= 0) {
+    exporter_close_client();
+  }
+
+  client.fd = client_fd;
+  client_offset = 0;
+  client_responding = 0;
+  uloop_fd_add(&client, ULOOP_READ);
+  uloop_timeout_set(&timer_client, EXPORTER_CLIENT_TIMEOUT);
+}
+
+void exporter_client_cb(struct uloop_fd *fd, unsigned int events)
+{
+  if (!client_responding) {
+    // The request itself is not interpreted, any request returns all metrics.
+    char request[512];
+    while (read(fd->fd, request, sizeof(request)) > 0);
+
+    if (exporter_render() != 0) {
+      exporter_close_client();
+      return;
+    }
+
+    client_responding = 1;
+    uloop_fd_add(fd, ULOOP_WRITE);
+  }
+
+  while (client_offset < buffer.length) {
+    ssize_t written = write(fd->fd, buffer.data + client_offset, buffer.length - client_offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      break;
+    }
+
+    client_offset += written;
+  }
+
+  exporter_close_client();
+}
+
+void exporter_client_timeout(struct uloop_timeout *timeout)
+{
+  exporter_close_client();
+}
+
+void exporter_close_client()
+{
+  uloop_timeout_cancel(&timer_client);
+  uloop_fd_delete(&client);
+  close(client.fd);
+  client.fd = -1;
+
+  // Resume accepting in case it was suspended while responding.
+  uloop_fd_add(&server, ULOOP_READ);
+}
+
+static inline void exporter_append(const char *data, size_t length)
+{
+  if (buffer.length + length > buffer.size) {
+    buffer.overflow = 1;
+    return;
+  }
+
+  memcpy(buffer.data + buffer.length, data, length);
+  buffer.length += length;
+}
+
+static inline void exporter_append_string(const char *string)
+{
+  exporter_append(string, strlen(string));
+}
+
+static inline void exporter_append_label_value(const char *string)
+{
+  for (const char *p = string; *p; p++) {
+    switch (*p) {
+      case '\\': exporter_append("\\\\", 2); break;
+      case '"': exporter_append("\\\"", 2); break;
+      case '\n': exporter_append("\\n", 2); break;
+      default: exporter_append(p, 1); break;
+    }
+  }
+}
+
+static inline void exporter_append_integer(int64_t value)
+{
+  char tmp[24];
+  size_t position = sizeof(tmp);
+  uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+
+  do {
+    tmp[--position] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+
+  if (value < 0) {
+    tmp[--position] = '-';
+  }
+
+  exporter_append(&tmp[position], sizeof(tmp) - position);
+}
+
+static inline void exporter_append_float(float value)
+{
+  double magnitude = value < 0 ? -(double) value : (double) value;
+  uint64_t scale = 1;
+  int decimals = 0;
+
+  if (isnan(value)) {
+    exporter_append_string("NaN");
+    return;
+  } else if (isinf(value)) {
+    exporter_append_string(value > 0 ? "+Inf" : "-Inf");
+    return;
+  } else if (value == 0) {
+    exporter_append("0", 1);
+    return;
+  }
+
+  // Scale the value to get enough significant digits.
+  while (magnitude < EXPORTER_MANTISSA_MIN && decimals < EXPORTER_DECIMALS_MAX) {
+    magnitude *= 10;
+    scale *= 10;
+    decimals++;
+  }
+
+  if (magnitude < EXPORTER_MANTISSA_MIN || magnitude >= 9e18) {
+    // Out of the integer range, such values are rare enough to use printf.
+    char tmp[32];
+    exporter_append(tmp, snprintf(tmp, sizeof(tmp), "%.7g", value));
+    return;
+  }
+
+  // Format as fixed point using integer arithmetic only.
+  uint64_t fixed = (uint64_t) (magnitude + 0.5);
+  if (value < 0) {
+    exporter_append("-", 1);
+  }
+  exporter_append_integer(fixed / scale);
+
+  // Drop trailing zeros of the fraction.
+  fixed %= scale;
+  while (decimals > 0 && fixed % 10 == 0) {
+    fixed /= 10;
+    scale /= 10;
+    decimals--;
+  }
+
+  if (decimals > 0) {
+    exporter_append(".", 1);
+    for (uint64_t digit = scale / 10; digit > 0; digit /= 10) {
+      char c = '0' + fixed / digit % 10;
+      exporter_append(&c, 1);
+    }
+  }
+}
+
+static inline void exporter_append_family(const char *name, const char *suffix,
+                                          const char *type, const char *help)
+{
+  exporter_append_string("# TYPE sfp_");
+  exporter_append_string(name);
+  exporter_append_string(suffix);
+  exporter_append(" ", 1);
+  exporter_append_string(type);
+  exporter_append_string("\n# HELP sfp_");
+  exporter_append_string(name);
+  exporter_append_string(suffix);
+  exporter_append(" ", 1);
+  exporter_append_string(help);
+  exporter_append("\n", 1);
+}
+
+static inline void exporter_append_sample_name(const char *name, const char *suffix,
+                                               struct sfp_module *module,
+                                               const char *label, const char *label_value)
+{
+  exporter_append_string("sfp_");
+  exporter_append_string(name);
+  exporter_append_string(suffix);
+  exporter_append_string("{module=\"");
+  exporter_append_label_value(module->serial_number);
+  if (label) {
+    exporter_append_string("\",");
+    exporter_append_string(label);
+    exporter_append_string("=\"");
+    exporter_append_label_value(label_value);
+  }
+  exporter_append_string("\"} ");
+}
+
+static inline void exporter_append_sample(const char *name, const char *suffix,
+                                          struct sfp_module *module,
+                                          const char *label, const char *label_value,
+                                          float value)
+{
+  exporter_append_sample_name(name, suffix, module, label, label_value);
+  exporter_append_float(value);
+  exporter_append("\n", 1);
+}
+
+static inline void exporter_append_counter(const char *name, const char *help, uint64_t value)
+{
+  exporter_append_family(name, "", "counter", help);
+  exporter_append_string("sfp_");
+  exporter_append_string(name);
+  exporter_append_string("_total ");
+  exporter_append_integer(value);
+  exporter_append("\n", 1);
+}
+
+static inline float diagnostics_value(struct sfp_diagnostics_item *item, const struct exporter_metric *metric)
+{
+  return *(float*) ((char*) item + metric->diagnostics_offset);
+}
+
+static inline struct sfp_statistics_item *statistics_item(struct sfp_module *module,
+                                                          const struct exporter_metric *metric)
+{
+  return (struct sfp_statistics_item*) ((char*) &module->statistics + metric->statistics_offset);
+}
+
+void exporter_render_metrics()
+{
+  struct avl_tree *modules = sfp_get_modules();
+  struct sfp_counters *counters = sfp_get_counters();
+  struct sfp_module *module;
+
+  exporter_append_string(EXPORTER_HEADER);
+
+  exporter_append_family("module", "", "info", "SFP module information");
+  avl_for_each_element(modules, module, avl) {
+    exporter_append_string("sfp_module_info{module=\"");
+    exporter_append_label_value(module->serial_number);
+    exporter_append_string("\",bus=\"");
+    exporter_append_label_value(module->bus);
+    exporter_append_string("\",manufacturer=\"");
+    exporter_append_label_value(module->manufacturer);
+    exporter_append_string("\",revision=\"");
+    exporter_append_label_value(module->revision);
+    exporter_append_string("\",wavelength=\"");
+    exporter_append_integer(module->wavelength);
+    exporter_append_string("\"} 1\n");
+
+    // Statistics are computed on demand.
+    sfp_update_module_statistics(module);
+  }
+
+  exporter_append_family("flag", "", "gauge", "SFP module status, alarm and warning flags");
+  avl_for_each_element(modules, module, avl) {
+    for (unsigned int flag = 0; flag < __SFP_FLAG_MAX; flag++) {
+      exporter_append_sample_name("flag", "", module, "flag", sfp_get_flag_name(flag));
+      exporter_append_integer((module->flags >> flag) & 1);
+      exporter_append("\n", 1);
+    }
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(exporter_metrics); i++) {
+    const struct exporter_metric *metric = &exporter_metrics[i];
+
+    exporter_append_family(metric->name, "", "gauge", metric->help);
+    avl_for_each_element(modules, module, avl) {
+      exporter_append_sample(metric->name, "", module, NULL, NULL,
+        diagnostics_value(&module->diagnostics.value, metric));
+    }
+
+    exporter_append_family(metric->name, "_threshold", "gauge", "Alarm and warning thresholds");
+    avl_for_each_element(modules, module, avl) {
+      struct sfp_diagnostics *d = &module->diagnostics;
+      exporter_append_sample(metric->name, "_threshold", module, "threshold", "error_upper",
+        diagnostics_value(&d->error_upper, metric));
+      exporter_append_sample(metric->name, "_threshold", module, "threshold", "error_lower",
+        diagnostics_value(&d->error_lower, metric));
+      exporter_append_sample(metric->name, "_threshold", module, "threshold", "warning_upper",
+        diagnostics_value(&d->warning_upper, metric));
+      exporter_append_sample(metric->name, "_threshold", module, "threshold", "warning_lower",
+        diagnostics_value(&d->warning_lower, metric));
+    }
+
+    exporter_append_family(metric->name, "_window", "gauge", "Statistics over the sampling window");
+    avl_for_each_element(modules, module, avl) {
+      struct sfp_statistics_item *item = statistics_item(module, metric);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "count", item->samples);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "average", item->average);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "variance", item->variance);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "minimum", item->minimum);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "maximum", item->maximum);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "p50", item->p50);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "p95", item->p95);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "p99", item->p99);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "ewma", item->ewma);
+      exporter_append_sample(metric->name, "_window", module, "statistic", "slope", item->slope);
+    }
+
+    exporter_append_family(metric->name, "_time_to_threshold_seconds", "gauge",
+      "Estimated time until the threshold is crossed");
+    avl_for_each_element(modules, module, avl) {
+      struct sfp_statistics_item *item = statistics_item(module, metric);
+      exporter_append_sample(metric->name, "_time_to_threshold_seconds", module, "threshold", "warning",
+        item->time_to_warning);
+      exporter_append_sample(metric->name, "_time_to_threshold_seconds", module, "threshold", "error",
+        item->time_to_error);
+    }
+  }
+
+  exporter_append_counter("driver_diagnostics_reads", "Successful diagnostics reads",
+    counters->diagnostics_reads);
+  exporter_append_counter("driver_diagnostics_errors", "Failed diagnostics reads",
+    counters->diagnostics_errors);
+  exporter_append_counter("driver_diagnostics_unchanged", "Diagnostics reads with unchanged measurements",
+    counters->diagnostics_unchanged);
+  exporter_append_counter("driver_discovery_probes", "Presence probes on unclaimed buses",
+    counters->discovery_probes);
+  exporter_append_counter("driver_threshold_refreshes", "Threshold refreshes",
+    counters->threshold_refreshes);
+  exporter_append_counter("driver_diagnostics_ticks", "Diagnostics update ticks",
+    counters->diagnostics_ticks);
+  exporter_append_counter("driver_diagnostics_jitter_accumulated_milliseconds",
+    "Total lateness of diagnostics update ticks",
+    counters->diagnostics_jitter_total);
+
+  exporter_append_family("driver_diagnostics_jitter", "_milliseconds", "gauge",
+    "Lateness of diagnostics update ticks");
+  exporter_append_string("sfp_driver_diagnostics_jitter_milliseconds{statistic=\"last\"} ");
+  exporter_append_integer(counters->diagnostics_jitter_last);
+  exporter_append_string("\nsfp_driver_diagnostics_jitter_milliseconds{statistic=\"maximum\"} ");
+  exporter_append_integer(counters->diagnostics_jitter_max);
+  exporter_append("\n", 1);
+  exporter_append_counter("driver_events", "Logged flag transitions", sfp_get_event_sequence());
+
+  exporter_append_string("# EOF\n");
+}
+
+int exporter_render()
+{
+  for (;;) {
+    buffer.length = 0;
+    buffer.overflow = 0;
+    exporter_render_metrics();
+    if (!buffer.overflow) {
+      return 0;
+    }
+
+    // Grow the buffer and render again.
+    char *data = (char*) realloc(buffer.data, buffer.size * 2);
+    if (!data) {
+      syslog(LOG_ERR, "Failed to grow metrics exporter buffer.");
+      return -1;
+    }
+
+    buffer.data = data;
+    buffer.size *= 2;
+  }
+}
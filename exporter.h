@@ -0,0 +1,27 @@
+/*
+ * sfp-driver - SFP driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SFP_DRIVER_EXPORTER_H
+#define SFP_DRIVER_EXPORTER_H
+
+// Default path of the metrics exporter socket.
+#define EXPORTER_SOCKET "/var/run/sfp-driver/metrics.sock"
+
+int exporter_init(const char *path);
+
+#endif
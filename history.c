@@ -0,0 +1,242 @@
+/*
+ * sfp-driver - SFP driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "history.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * Binary history stream layout. All integers are unsigned LEB128 varints
+ * unless noted otherwise.
+ *
+ *   magic "SFPH" (4 bytes), version (1 byte), module count
+ *   for each module:
+ *     serial number length, serial number bytes,
+ *     sample count, sample period (ms), sample timestamps (ms since epoch),
+ *     metric count
+ *     for each metric:
+ *       metric identifier (1 byte), flags (1 byte, bit 0 = signed samples),
+ *       divisor, samples
+ *
+ * All metrics of a module are sampled together, so they share the sample
+ * count and timestamps. Samples are raw 16-bit words (sign extended for signed
+ * metrics). Both are ordered from the oldest one and encoded as zigzag varints.
+ * The first timestamp is encoded as is, each following one as the difference
+ * from the previous one less the sample period, so regular samples take a
+ * single byte. Samples are encoded as the difference from the previous one (the
+ * first one from zero). Dividing a sample by the divisor gives its value.
+ *
+ * Timestamps are those of the actual reads, as updates may be late or skipped
+ * and failed reads produce no sample. The stream only holds the samples in the
+ * statistics windows, that is the last SFP_STATISTICS_BUFFER_SIZE updates (one
+ * minute at the default update interval). Collectors needing a longer history
+ * must fetch it at least once per window and concatenate the samples.
+ */
+#define HISTORY_MAGIC "SFPH"
+#define HISTORY_METRIC_COUNT 5
+// Maximum encoded size of a varint holding a 64-bit value.
+#define HISTORY_VARINT_MAX 10
+// Maximum encoded size of a sample delta (17-bit zigzag value).
+#define HISTORY_DELTA_MAX 3
+
+struct history_writer {
+  uint8_t *data;
+  size_t size;
+  size_t length;
+  int overflow;
+};
+
+static inline void history_put_byte(struct history_writer *writer, uint8_t value)
+{
+  if (writer->length >= writer->size) {
+    writer->overflow = 1;
+    return;
+  }
+
+  writer->data[writer->length++] = value;
+}
+
+static inline void history_put_varint(struct history_writer *writer, uint64_t value)
+{
+  while (value >= 0x80) {
+    history_put_byte(writer, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  history_put_byte(writer, value);
+}
+
+static inline void history_put_zigzag(struct history_writer *writer, int64_t value)
+{
+  history_put_varint(writer, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+static inline void history_put_data(struct history_writer *writer, const void *data, size_t length)
+{
+  if (writer->length + length > writer->size) {
+    writer->overflow = 1;
+    return;
+  }
+
+  memcpy(writer->data + writer->length, data, length);
+  writer->length += length;
+}
+
+static void history_put_metric(struct history_writer *writer,
+                               uint8_t metric,
+                               struct sfp_statistics_item *item)
+{
+  history_put_byte(writer, metric);
+  history_put_byte(writer, item->is_signed ? 1 : 0);
+  history_put_varint(writer, item->divisor);
+
+  // Samples are stored oldest first, starting at the oldest one in the window.
+  size_t index = item->samples < SFP_STATISTICS_BUFFER_SIZE ? 0 : item->index;
+  int32_t previous = 0;
+  for (size_t i = 0; i < item->samples; i++) {
+    uint16_t raw = item->buffer[(index + i) % SFP_STATISTICS_BUFFER_SIZE];
+    int32_t value = item->is_signed ? (int16_t) raw : raw;
+    history_put_zigzag(writer, value - previous);
+    previous = value;
+  }
+}
+
+static void history_put_module(struct history_writer *writer, struct sfp_module *module)
+{
+  // Apply any pending repeated samples to the statistics windows.
+  sfp_update_module_statistics(module);
+
+  size_t length = strlen(module->serial_number);
+  history_put_varint(writer, length);
+  history_put_data(writer, module->serial_number, length);
+
+  // Sample times are kept at the same positions as samples in the windows.
+  struct sfp_statistics_item *window = &module->statistics.temperature;
+  size_t index = window->samples < SFP_STATISTICS_BUFFER_SIZE ? 0 : window->index;
+  history_put_varint(writer, window->samples);
+  history_put_varint(writer, SFP_UPDATE_INTERVAL);
+  for (size_t i = 0; i < window->samples; i++) {
+    int64_t timestamp = module->sample_timestamps[(index + i) % SFP_STATISTICS_BUFFER_SIZE];
+    if (i == 0) {
+      history_put_zigzag(writer, timestamp);
+    } else {
+      int64_t previous = module->sample_timestamps[(index + i - 1) % SFP_STATISTICS_BUFFER_SIZE];
+      history_put_zigzag(writer, timestamp - previous - SFP_UPDATE_INTERVAL);
+    }
+  }
+
+  history_put_varint(writer, HISTORY_METRIC_COUNT);
+  history_put_metric(writer, 0, &module->statistics.temperature);
+  history_put_metric(writer, 1, &module->statistics.vcc);
+  history_put_metric(writer, 2, &module->statistics.tx_bias);
+  history_put_metric(writer, 3, &module->statistics.tx_power);
+  history_put_metric(writer, 4, &module->statistics.rx_power);
+}
+
+static inline size_t history_get_module_max_size(struct sfp_module *module)
+{
+  return 4 * HISTORY_VARINT_MAX + strlen(module->serial_number) +
+    SFP_STATISTICS_BUFFER_SIZE * HISTORY_VARINT_MAX +
+    HISTORY_METRIC_COUNT * (2 + HISTORY_VARINT_MAX + SFP_STATISTICS_BUFFER_SIZE * HISTORY_DELTA_MAX);
+}
+
+size_t history_get_max_size(struct sfp_module *module)
+{
+  size_t size = strlen(HISTORY_MAGIC) + 1 + HISTORY_VARINT_MAX;
+
+  if (module) {
+    size += history_get_module_max_size(module);
+  } else {
+    avl_for_each_element(sfp_get_modules(), module, avl) {
+      size += history_get_module_max_size(module);
+    }
+  }
+
+  return size;
+}
+
+ssize_t history_encode(struct sfp_module *module, uint8_t *buffer, size_t size)
+{
+  struct history_writer writer = { .data = buffer, .size = size };
+
+  history_put_data(&writer, HISTORY_MAGIC, strlen(HISTORY_MAGIC));
+  history_put_byte(&writer, HISTORY_FORMAT_VERSION);
+
+  if (module) {
+    history_put_varint(&writer, 1);
+    history_put_module(&writer, module);
+  } else {
+    history_put_varint(&writer, sfp_get_modules()->count);
+    avl_for_each_element(sfp_get_modules(), module, avl) {
+      history_put_module(&writer, module);
+    }
+  }
+
+  if (writer.overflow) {
+    return -1;
+  }
+
+  return writer.length;
+}
+
+ssize_t history_dump(struct sfp_module *module, const char *path)
+{
+  size_t size = history_get_max_size(module);
+  uint8_t *buffer = (uint8_t*) malloc(size);
+  if (!buffer) {
+    return -1;
+  }
+
+  ssize_t length = history_encode(module, buffer, size);
+  if (length < 0) {
+    free(buffer);
+    return -1;
+  }
+
+  // Write to a temporary file first, so readers never see a partial dump.
+  char tmp_path[256];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    free(buffer);
+    return -1;
+  }
+
+  ssize_t written = 0;
+  while (written < length) {
+    ssize_t result = write(fd, buffer + written, length - written);
+    if (result < 0) {
+      break;
+    }
+    written += result;
+  }
+
+  close(fd);
+  free(buffer);
+
+  if (written < length || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+
+  return length;
+}
@@ -0,0 +1,35 @@
+/*
+ * sfp-driver - SFP driver
+ *
+ * Copyright (C) 2016 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SFP_DRIVER_HISTORY_H
+#define SFP_DRIVER_HISTORY_H
+
+#include "sfp.h"
+
+#include <sys/types.h>
+
+// Binary history format version.
+#define HISTORY_FORMAT_VERSION 1
+// Default path of the binary history dump.
+#define HISTORY_DUMP_PATH "/var/run/sfp-driver/history.bin"
+
+size_t history_get_max_size(struct sfp_module *module);
+ssize_t history_encode(struct sfp_module *module, uint8_t *buffer, size_t size);
+ssize_t history_dump(struct sfp_module *module, const char *path);
+
+#endif
@@ -28,6 +28,7 @@
 
 #include "sfp.h"
 #include "ubus.h"
+#include "exporter.h"
 
 // Global ubus connection context.
 static struct ubus_context *ubus;
@@ -38,12 +39,14 @@ int main(int argc, char **argv)
 {
   struct stat s;
   const char *ubus_socket = NULL;
+  const char *exporter_socket = EXPORTER_SOCKET;
   int log_option = 0;
   int c;
 
-  while ((c = getopt(argc, argv, "s:")) != -1) {
+  while ((c = getopt(argc, argv, "s:m:")) != -1) {
     switch (c) {
       case 's': ubus_socket = optarg; break;
+      case 'm': exporter_socket = optarg; break;
       case 'f': log_option |= LOG_PERROR; break;
       default: break;
     }
@@ -95,6 +98,11 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  // Metrics exporter is optional, so failing to initialize it is not fatal.
+  if (exporter_init(exporter_socket) != 0) {
+    syslog(LOG_WARNING, "Failed to initialize metrics exporter!");
+  }
+
   // Enter the event loop and cleanup after it exits.
   uloop_run();
   ubus_free(ubus);
@@ -30,11 +30,22 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
 
 #define SFP_I2C_PROBE_BUS_MAX 5
 #define SFP_I2C_INFO_ADDRESS 0x50
 #define SFP_I2C_DIAG_ADDRESS 0x51
 
+// Low priority I/O is not started when diagnostics are due sooner than this
+// (in milliseconds).
+#define SFP_IO_GUARD_TIME 20
+// Module information is read in chunks of this size, one per low priority
+// request. Together with the threshold block, this bounds a single request to
+// a few tens of byte transfers, which complete well within the guard time.
+#define SFP_IO_INFO_CHUNK_LENGTH 32
+
+#define SFP_INFO_LENGTH 128
+
 #define SFP_MANUFACTURER_OFFSET 20
 #define SFP_MANUFACTURER_LENGTH 16
 
@@ -42,7 +53,6 @@
 #define SFP_REVISION_LENGTH 4
 
 #define SFP_SERIAL_NO_OFFSET 68
-#define SFP_SERIAL_NO_LENGTH 16
 
 #define SFP_TYPE_OFFSET 0
 #define SFP_CONNECTOR_OFFSET 2
@@ -56,6 +66,12 @@
 #define SFP_DIAG_VALUE_OFFSET 96
 #define SFP_DIAG_VALUE_STRIDE 2
 
+#define SFP_DIAG_THRESHOLD_OFFSET 0
+
+// Measurement block covers values, status and alarm/warning flags.
+#define SFP_DIAG_MEASUREMENT_OFFSET 96
+#define SFP_DIAG_MEASUREMENT_LENGTH 22
+
 #define SFP_DIAG_ERROR_UP_OFFSET 0
 #define SFP_DIAG_ERROR_UP_STRIDE 8
 
@@ -68,26 +84,131 @@
 #define SFP_DIAG_WARNING_LO_OFFSET 6
 #define SFP_DIAG_WARNING_LO_STRIDE 8
 
+#define SFP_TEMPERATURE_DIVISOR 256
+#define SFP_VCC_DIVISOR 10000
+#define SFP_TX_BIAS_DIVISOR 500
+#define SFP_TX_POWER_DIVISOR 10000
+#define SFP_RX_POWER_DIVISOR 10000
+
+#define SFP_DIAG_STATUS_OFFSET 110
+#define SFP_DIAG_ALARM_OFFSET 112
+#define SFP_DIAG_WARNING_OFFSET 116
+
+struct sfp_flag_definition {
+  const char *name;
+  size_t offset;
+  uint8_t mask;
+};
+
+// Location of flags in the diagnostics memory (A2h) as per SFF-8472.
+static const struct sfp_flag_definition sfp_flags[__SFP_FLAG_MAX] = {
+  [SFP_FLAG_TX_FAULT] = { "tx_fault", SFP_DIAG_STATUS_OFFSET, 0x04 },
+  [SFP_FLAG_RX_LOS] = { "rx_los", SFP_DIAG_STATUS_OFFSET, 0x02 },
+  [SFP_FLAG_TEMPERATURE_HIGH_ALARM] = { "temperature_high_alarm", SFP_DIAG_ALARM_OFFSET, 0x80 },
+  [SFP_FLAG_TEMPERATURE_LOW_ALARM] = { "temperature_low_alarm", SFP_DIAG_ALARM_OFFSET, 0x40 },
+  [SFP_FLAG_VCC_HIGH_ALARM] = { "vcc_high_alarm", SFP_DIAG_ALARM_OFFSET, 0x20 },
+  [SFP_FLAG_VCC_LOW_ALARM] = { "vcc_low_alarm", SFP_DIAG_ALARM_OFFSET, 0x10 },
+  [SFP_FLAG_TX_BIAS_HIGH_ALARM] = { "tx_bias_high_alarm", SFP_DIAG_ALARM_OFFSET, 0x08 },
+  [SFP_FLAG_TX_BIAS_LOW_ALARM] = { "tx_bias_low_alarm", SFP_DIAG_ALARM_OFFSET, 0x04 },
+  [SFP_FLAG_TX_POWER_HIGH_ALARM] = { "tx_power_high_alarm", SFP_DIAG_ALARM_OFFSET, 0x02 },
+  [SFP_FLAG_TX_POWER_LOW_ALARM] = { "tx_power_low_alarm", SFP_DIAG_ALARM_OFFSET, 0x01 },
+  [SFP_FLAG_RX_POWER_HIGH_ALARM] = { "rx_power_high_alarm", SFP_DIAG_ALARM_OFFSET + 1, 0x80 },
+  [SFP_FLAG_RX_POWER_LOW_ALARM] = { "rx_power_low_alarm", SFP_DIAG_ALARM_OFFSET + 1, 0x40 },
+  [SFP_FLAG_TEMPERATURE_HIGH_WARNING] = { "temperature_high_warning", SFP_DIAG_WARNING_OFFSET, 0x80 },
+  [SFP_FLAG_TEMPERATURE_LOW_WARNING] = { "temperature_low_warning", SFP_DIAG_WARNING_OFFSET, 0x40 },
+  [SFP_FLAG_VCC_HIGH_WARNING] = { "vcc_high_warning", SFP_DIAG_WARNING_OFFSET, 0x20 },
+  [SFP_FLAG_VCC_LOW_WARNING] = { "vcc_low_warning", SFP_DIAG_WARNING_OFFSET, 0x10 },
+  [SFP_FLAG_TX_BIAS_HIGH_WARNING] = { "tx_bias_high_warning", SFP_DIAG_WARNING_OFFSET, 0x08 },
+  [SFP_FLAG_TX_BIAS_LOW_WARNING] = { "tx_bias_low_warning", SFP_DIAG_WARNING_OFFSET, 0x04 },
+  [SFP_FLAG_TX_POWER_HIGH_WARNING] = { "tx_power_high_warning", SFP_DIAG_WARNING_OFFSET, 0x02 },
+  [SFP_FLAG_TX_POWER_LOW_WARNING] = { "tx_power_low_warning", SFP_DIAG_WARNING_OFFSET, 0x01 },
+  [SFP_FLAG_RX_POWER_HIGH_WARNING] = { "rx_power_high_warning", SFP_DIAG_WARNING_OFFSET + 1, 0x80 },
+  [SFP_FLAG_RX_POWER_LOW_WARNING] = { "rx_power_low_warning", SFP_DIAG_WARNING_OFFSET + 1, 0x40 },
+};
+
+// Low priority I/O requests which can be queued on a bus, in order of priority.
+// Diagnostics updates are issued directly from their timer and take precedence
+// over all of them.
+enum {
+  SFP_IO_THRESHOLDS = 1 << 0,
+  SFP_IO_DISCOVERY = 1 << 1,
+  SFP_IO_PROBE = 1 << 2,
+};
+
+struct sfp_bus {
+  char name[64];
+  // Module discovered on this bus.
+  struct sfp_module *module;
+  // Queued I/O requests (bitset of SFP_IO_* values).
+  unsigned int pending;
+  // Number of consecutive presence probes which found no module.
+  unsigned int empty_probes;
+  // Earliest time of the next presence probe (monotonic, in milliseconds).
+  uint64_t next_probe;
+  // Module information read so far by discovery.
+  uint8_t info[SFP_INFO_LENGTH];
+  size_t info_length;
+};
+
 // An AVL tree containing all the registered SFP modules.
 static struct avl_tree module_registry;
+// Probed I2C buses.
+static struct sfp_bus buses[SFP_I2C_PROBE_BUS_MAX];
+// Bus to be served first by the next low priority I/O dispatch.
+static unsigned int next_bus;
 // Timer for periodic SFP module autodiscovery.
 struct uloop_timeout timer_autodiscovery;
 // Timer for SFP module diagnostic updates.
 struct uloop_timeout timer_update_diagnostics;
+// Timer for SFP module threshold refreshes.
+struct uloop_timeout timer_update_thresholds;
+// Timer for dispatching low priority I/O.
+struct uloop_timeout timer_io;
+// Time when the next diagnostics update is due (monotonic, in milliseconds).
+static uint64_t diagnostics_deadline;
+// Time of the last autodiscovery run (monotonic, in milliseconds).
+static uint64_t autodiscovery_time;
+// Ring buffer of flag transition events.
+static struct sfp_event event_log[SFP_EVENT_BUFFER_SIZE];
+// Sequence number of the next event.
+static uint32_t event_sequence;
+// Driver counters.
+static struct sfp_counters counters;
 
 void sfp_module_autodiscovery(struct uloop_timeout *timeout);
 void sfp_module_diagnostics(struct uloop_timeout *timeout);
-int sfp_init_module(const char *bus);
+void sfp_module_thresholds(struct uloop_timeout *timeout);
+void sfp_io_schedule();
+void sfp_io_dispatch(struct uloop_timeout *timeout);
+int sfp_probe_module(struct sfp_bus *bus);
+int sfp_discover_module(struct sfp_bus *bus);
+void sfp_backoff_discovery(struct sfp_bus *bus);
+int sfp_init_module(struct sfp_bus *bus);
 void sfp_free_module(struct sfp_module *module);
+int sfp_read_module_diagnostics(struct sfp_module *module);
 int sfp_update_module_diagnostics(struct sfp_module *module);
+int sfp_update_module_thresholds(struct sfp_module *module);
+void sfp_module_diagnostics_requests(struct uloop_timeout *timeout);
+void sfp_complete_module_diagnostics_requests(struct sfp_module *module, int status);
 int sfp_update_module_diagnostics_item(struct sfp_diagnostics_item *item, uint8_t *buffer, size_t stride);
-void sfp_update_module_statistics_item(struct sfp_statistics_item *item, float value);
+void sfp_init_module_statistics_item(struct sfp_statistics_item *item, uint16_t divisor, int is_signed);
+void sfp_update_module_statistics_item(struct sfp_statistics_item *item, uint16_t raw);
+void sfp_repeat_module_statistics_item(struct sfp_statistics_item *item);
 void sfp_compute_module_statistics_item(struct sfp_statistics_item *item);
+void sfp_update_module_trend(struct sfp_module *module);
+void sfp_update_module_statistics_trend(struct sfp_statistics_item *item, uint32_t *times,
+                                        size_t points, size_t index);
+void sfp_compute_module_statistics_trend(struct sfp_statistics_item *item,
+                                         float warning_lower, float warning_upper,
+                                         float error_lower, float error_upper);
+uint32_t sfp_decode_module_flags(uint8_t *buffer);
+void sfp_update_module_flags(struct sfp_module *module, uint32_t flags);
+void sfp_log_event(struct sfp_module *module, unsigned int flag, int state);
 void sfp_copy_string(char **destination, uint8_t *buffer, size_t offset, size_t length);
 void sfp_copy_data(uint8_t **destination, uint8_t *buffer, size_t offset, size_t length);
 int i2c_open(const char *bus, int address);
 int i2c_close(int i2c_bus);
-int i2c_read_data(int i2c_bus, uint8_t *data, size_t size);
+int i2c_read_data(int i2c_bus, uint8_t offset, uint8_t *data, size_t size);
 
 int sfp_init(struct uci_context *uci)
 {
@@ -96,10 +217,20 @@ int sfp_init(struct uci_context *uci)
   // Initialize the module registry.
   avl_init(&module_registry, avl_strcmp, false, NULL);
 
+  // Initialize buses.
+  for (unsigned int bus = 0; bus < SFP_I2C_PROBE_BUS_MAX; bus++) {
+    snprintf(buses[bus].name, sizeof(buses[bus].name), "/dev/i2c-%u", bus);
+  }
+
   // Initialize timers.
+  timer_io.cb = sfp_io_dispatch;
+
   timer_autodiscovery.cb = sfp_module_autodiscovery;
   sfp_module_autodiscovery(&timer_autodiscovery);
 
+  timer_update_thresholds.cb = sfp_module_thresholds;
+  uloop_timeout_set(&timer_update_thresholds, SFP_THRESHOLD_INTERVAL);
+
   timer_update_diagnostics.cb = sfp_module_diagnostics;
   sfp_module_diagnostics(&timer_update_diagnostics);
 
@@ -111,55 +242,260 @@ struct avl_tree *sfp_get_modules()
   return &module_registry;
 }
 
+struct sfp_counters *sfp_get_counters()
+{
+  return &counters;
+}
+
+const char *sfp_get_flag_name(unsigned int flag)
+{
+  if (flag >= __SFP_FLAG_MAX) {
+    return NULL;
+  }
+
+  return sfp_flags[flag].name;
+}
+
+uint32_t sfp_get_event_sequence()
+{
+  return event_sequence;
+}
+
+struct sfp_event *sfp_get_event(uint32_t sequence)
+{
+  // Only the last SFP_EVENT_BUFFER_SIZE events are retained.
+  if (sequence >= event_sequence || event_sequence - sequence > SFP_EVENT_BUFFER_SIZE) {
+    return NULL;
+  }
+
+  return &event_log[sequence % SFP_EVENT_BUFFER_SIZE];
+}
+
+static inline uint64_t sfp_monotonic_time()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 void sfp_module_autodiscovery(struct uloop_timeout *timeout)
 {
-  // Attempt to autodiscover SFP modules on all I2C buses.
-  for (unsigned int bus = 0; bus < SFP_I2C_PROBE_BUS_MAX; bus++) {
-    char bus_name[64];
-    struct sfp_module *module;
-    snprintf(bus_name, sizeof(bus_name), "/dev/i2c-%u", bus);
-
-    // Skip bus if a module has already been discovered on it.
-    int exists = 0;
-    avl_for_each_element(&module_registry, module, avl) {
-      if (strcmp(module->bus, bus_name) == 0) {
-        exists = 1;
-        break;
-      }
+  autodiscovery_time = sfp_monotonic_time();
+
+  // Queue presence probes on all unclaimed buses which are not backing off or
+  // already being discovered.
+  for (unsigned int i = 0; i < SFP_I2C_PROBE_BUS_MAX; i++) {
+    struct sfp_bus *bus = &buses[i];
+    if (!bus->module && !(bus->pending & SFP_IO_DISCOVERY) && autodiscovery_time >= bus->next_probe) {
+      bus->pending |= SFP_IO_PROBE;
     }
+  }
+
+  sfp_io_schedule();
+  uloop_timeout_set(timeout, SFP_AUTODISCOVERY_INTERVAL);
+}
 
-    if (!exists) {
-      sfp_init_module(bus_name);
+void sfp_module_thresholds(struct uloop_timeout *timeout)
+{
+  for (unsigned int i = 0; i < SFP_I2C_PROBE_BUS_MAX; i++) {
+    if (buses[i].module) {
+      buses[i].pending |= SFP_IO_THRESHOLDS;
     }
   }
 
-  uloop_timeout_set(timeout, SFP_AUTODISCOVERY_INTERVAL);
+  sfp_io_schedule();
+  uloop_timeout_set(timeout, SFP_THRESHOLD_INTERVAL);
 }
 
 void sfp_module_diagnostics(struct uloop_timeout *timeout)
 {
+  uint64_t now = sfp_monotonic_time();
+
+  // Track how late the update is compared to when it was due.
+  if (diagnostics_deadline) {
+    uint32_t jitter = now > diagnostics_deadline ? now - diagnostics_deadline : 0;
+    counters.diagnostics_ticks++;
+    counters.diagnostics_jitter_total += jitter;
+    counters.diagnostics_jitter_last = jitter;
+    if (jitter > counters.diagnostics_jitter_max) {
+      counters.diagnostics_jitter_max = jitter;
+    }
+  } else {
+    diagnostics_deadline = now;
+  }
+
   struct sfp_module *module;
   avl_for_each_element(&module_registry, module, avl) {
     sfp_update_module_diagnostics(module);
   }
 
-  uloop_timeout_set(timeout, SFP_UPDATE_INTERVAL);
+  // Updates are due at fixed intervals from the previous deadline, so the time
+  // spent reading does not accumulate as drift. Updates which were missed
+  // entirely are skipped rather than issued back to back.
+  now = sfp_monotonic_time();
+  do {
+    diagnostics_deadline += SFP_UPDATE_INTERVAL;
+  } while (diagnostics_deadline < now);
+  uloop_timeout_set(timeout, diagnostics_deadline - now);
+
+  // Queued low priority I/O may use the time until the next update.
+  sfp_io_schedule();
+}
+
+void sfp_io_schedule()
+{
+  if (!timer_io.pending) {
+    uloop_timeout_set(&timer_io, 0);
+  }
+}
+
+void sfp_io_dispatch(struct uloop_timeout *timeout)
+{
+  // Do not start low priority I/O when diagnostics are about to be updated,
+  // dispatch is retried after the update.
+  if (sfp_monotonic_time() + SFP_IO_GUARD_TIME > diagnostics_deadline) {
+    return;
+  }
+
+  // Serve a single request, buses are served in round-robin order.
+  for (unsigned int request = SFP_IO_THRESHOLDS; request <= SFP_IO_PROBE; request <<= 1) {
+    for (unsigned int i = 0; i < SFP_I2C_PROBE_BUS_MAX; i++) {
+      unsigned int index = (next_bus + i) % SFP_I2C_PROBE_BUS_MAX;
+      struct sfp_bus *bus = &buses[index];
+      if (!(bus->pending & request)) {
+        continue;
+      }
+
+      bus->pending &= ~request;
+      next_bus = (index + 1) % SFP_I2C_PROBE_BUS_MAX;
+
+      if (request == SFP_IO_THRESHOLDS && bus->module) {
+        sfp_update_module_thresholds(bus->module);
+      } else if (request == SFP_IO_DISCOVERY && !bus->module) {
+        sfp_discover_module(bus);
+      } else if (request == SFP_IO_PROBE && !bus->module) {
+        sfp_probe_module(bus);
+      }
+
+      // Let the event loop run before serving the next request.
+      sfp_io_schedule();
+      return;
+    }
+  }
 }
 
-int sfp_init_module(const char *bus)
+int sfp_probe_module(struct sfp_bus *bus)
 {
-  int result = 0;
-  int i2c_bus = i2c_open(bus, SFP_I2C_INFO_ADDRESS);
+  counters.discovery_probes++;
+
+  int i2c_bus = i2c_open(bus->name, SFP_I2C_INFO_ADDRESS);
   if (i2c_bus < 0) {
+    sfp_backoff_discovery(bus);
     return -1;
   }
 
-  uint8_t buffer[256];
-  if (i2c_read_data(i2c_bus, buffer, sizeof(buffer)) <= 0) {
-    i2c_close(i2c_bus);
+  uint8_t type;
+  int result = i2c_read_data(i2c_bus, SFP_TYPE_OFFSET, &type, sizeof(type));
+  i2c_close(i2c_bus);
+
+  if (result != (int) sizeof(type)) {
+    sfp_backoff_discovery(bus);
     return -1;
   }
 
+  // Only read the whole module information when a module responds.
+  bus->info_length = 0;
+  bus->pending |= SFP_IO_DISCOVERY;
+  return 0;
+}
+
+int sfp_discover_module(struct sfp_bus *bus)
+{
+  int i2c_bus = i2c_open(bus->name, SFP_I2C_INFO_ADDRESS);
+  if (i2c_bus < 0) {
+    sfp_backoff_discovery(bus);
+    return -1;
+  }
+
+  // Read the next chunk of module information.
+  size_t length = SFP_INFO_LENGTH - bus->info_length;
+  if (length > SFP_IO_INFO_CHUNK_LENGTH) {
+    length = SFP_IO_INFO_CHUNK_LENGTH;
+  }
+
+  int result = i2c_read_data(i2c_bus, bus->info_length, &bus->info[bus->info_length], length);
+  i2c_close(i2c_bus);
+
+  if (result < (int) length) {
+    sfp_backoff_discovery(bus);
+    return -1;
+  }
+
+  bus->info_length += length;
+  if (bus->info_length < SFP_INFO_LENGTH) {
+    bus->pending |= SFP_IO_DISCOVERY;
+    return 0;
+  }
+
+  if (sfp_init_module(bus) != 0) {
+    sfp_backoff_discovery(bus);
+    return -1;
+  }
+
+  bus->empty_probes = 0;
+  return 0;
+}
+
+void sfp_backoff_discovery(struct sfp_bus *bus)
+{
+  // Back off exponentially on buses which remain empty.
+  uint64_t interval = (uint64_t) SFP_AUTODISCOVERY_INTERVAL << bus->empty_probes;
+  if (interval < SFP_AUTODISCOVERY_INTERVAL_MAX) {
+    bus->empty_probes++;
+  } else {
+    interval = SFP_AUTODISCOVERY_INTERVAL_MAX;
+  }
+
+  // Probes only run after the autodiscovery run which queued them, so the
+  // interval is counted from that run. Otherwise the next run would come just
+  // before the probe is due and skip it.
+  bus->next_probe = autodiscovery_time + interval;
+}
+
+void sfp_request_module_diagnostics(struct sfp_module *module, struct sfp_diagnostics_request *request)
+{
+  list_add_tail(&request->list, &module->diagnostics_requests);
+
+  // Schedule an immediate read unless one is already scheduled, so that all
+  // requests queued until then are served by the same read.
+  if (!module->timer_diagnostics_requests.pending) {
+    uloop_timeout_set(&module->timer_diagnostics_requests, 0);
+  }
+}
+
+void sfp_module_diagnostics_requests(struct uloop_timeout *timeout)
+{
+  struct sfp_module *module = container_of(timeout, struct sfp_module, timer_diagnostics_requests);
+  sfp_read_module_diagnostics(module);
+}
+
+void sfp_complete_module_diagnostics_requests(struct sfp_module *module, int status)
+{
+  struct sfp_diagnostics_request *request, *tmp;
+
+  // Any read started after a request has been queued satisfies it.
+  uloop_timeout_cancel(&module->timer_diagnostics_requests);
+
+  list_for_each_entry_safe(request, tmp, &module->diagnostics_requests, list) {
+    list_del(&request->list);
+    request->cb(request, module, status);
+  }
+}
+
+int sfp_init_module(struct sfp_bus *bus)
+{
+  uint8_t *buffer = bus->info;
+
   // Verify checksum.
   uint8_t checksum = 0;
   for (size_t i = 0; i < SFP_CHECKSUM_OFFSET; i++) {
@@ -167,16 +503,22 @@ int sfp_init_module(const char *bus)
   }
 
   if (checksum != buffer[SFP_CHECKSUM_OFFSET]) {
-    i2c_close(i2c_bus);
     return -1;
   }
 
   struct sfp_module *module = (struct sfp_module*) malloc(sizeof(struct sfp_module));
   memset(module, 0, sizeof(struct sfp_module));
-  module->bus = strdup(bus);
+  module->bus = strdup(bus->name);
+  INIT_LIST_HEAD(&module->diagnostics_requests);
+  module->timer_diagnostics_requests.cb = sfp_module_diagnostics_requests;
+  sfp_init_module_statistics_item(&module->statistics.temperature, SFP_TEMPERATURE_DIVISOR, 1);
+  sfp_init_module_statistics_item(&module->statistics.vcc, SFP_VCC_DIVISOR, 0);
+  sfp_init_module_statistics_item(&module->statistics.tx_bias, SFP_TX_BIAS_DIVISOR, 0);
+  sfp_init_module_statistics_item(&module->statistics.tx_power, SFP_TX_POWER_DIVISOR, 0);
+  sfp_init_module_statistics_item(&module->statistics.rx_power, SFP_RX_POWER_DIVISOR, 0);
   sfp_copy_string(&module->manufacturer, buffer, SFP_MANUFACTURER_OFFSET, SFP_MANUFACTURER_LENGTH);
   sfp_copy_string(&module->revision, buffer, SFP_REVISION_OFFSET, SFP_REVISION_LENGTH);
-  sfp_copy_string(&module->serial_number, buffer, SFP_SERIAL_NO_OFFSET, SFP_SERIAL_NO_LENGTH);
+  sfp_copy_string(&module->serial_number, buffer, SFP_SERIAL_NO_OFFSET, SFP_SERIAL_NUMBER_LENGTH);
   module->type = (unsigned int) buffer[SFP_TYPE_OFFSET];
   module->connector = (unsigned int) buffer[SFP_CONNECTOR_OFFSET];
   module->bitrate = (unsigned int) buffer[SFP_BITRATE_OFFSET] * 100;
@@ -189,13 +531,13 @@ int sfp_init_module(const char *bus)
   module->avl.key = module->serial_number;
   if (avl_insert(&module_registry, &module->avl) != 0) {
     sfp_free_module(module);
-    result = -1;
+    return -1;
   }
 
-  i2c_close(i2c_bus);
+  bus->module = module;
 
   // Output some information about the newly discovered SFP module.
-  syslog(LOG_INFO, "Discovered new SFP module on bus '%s':", bus);
+  syslog(LOG_INFO, "Discovered new SFP module on bus '%s':", bus->name);
   syslog(LOG_INFO, "  Manufacturer: %s", module->manufacturer);
   syslog(LOG_INFO, "  Serial number: %s", module->serial_number);
   syslog(LOG_INFO, "  Type: 0x%02X", module->type);
@@ -203,10 +545,11 @@ int sfp_init_module(const char *bus)
   syslog(LOG_INFO, "  Bitrate: %u MBd", module->bitrate);
   syslog(LOG_INFO, "  Wavelength: %u nm", module->wavelength);
 
-  // Update diagnostics.
-  sfp_update_module_diagnostics(module);
+  // Thresholds are read by a separate request, diagnostics are first read by
+  // the next periodic update.
+  bus->pending |= SFP_IO_THRESHOLDS;
 
-  return result;
+  return 0;
 }
 
 void sfp_free_module(struct sfp_module *module)
@@ -218,94 +561,456 @@ void sfp_free_module(struct sfp_module *module)
   free(module);
 }
 
+static inline uint16_t convert_raw(uint8_t *data)
+{
+  return (data[0] << 8) + data[1];
+}
+
 static inline float convert_number(uint8_t *data, uint16_t divisor, int is_signed)
 {
   if (is_signed) {
-    return ((int16_t) ((data[0] << 8) + data[1])) / (float) divisor;
+    return ((int16_t) convert_raw(data)) / (float) divisor;
   } else {
-    return ((uint16_t) ((data[0] << 8) + data[1])) / (float) divisor;
+    return convert_raw(data) / (float) divisor;
   }
 }
 
 int sfp_update_module_diagnostics_item(struct sfp_diagnostics_item *item, uint8_t *buffer, size_t stride)
 {
-  item->temperature = convert_number(&buffer[0], 256, 1);
-  item->vcc = convert_number(&buffer[stride], 10000, 0);
-  item->tx_bias = convert_number(&buffer[2 * stride], 500, 0);
-  item->tx_power = convert_number(&buffer[3 * stride], 10000, 0);
-  item->rx_power = convert_number(&buffer[4 * stride], 10000, 0);
+  item->temperature = convert_number(&buffer[0], SFP_TEMPERATURE_DIVISOR, 1);
+  item->vcc = convert_number(&buffer[stride], SFP_VCC_DIVISOR, 0);
+  item->tx_bias = convert_number(&buffer[2 * stride], SFP_TX_BIAS_DIVISOR, 0);
+  item->tx_power = convert_number(&buffer[3 * stride], SFP_TX_POWER_DIVISOR, 0);
+  item->rx_power = convert_number(&buffer[4 * stride], SFP_RX_POWER_DIVISOR, 0);
   return 0;
 }
 
-void sfp_update_module_statistics_item(struct sfp_statistics_item *item, float value)
+void sfp_init_module_statistics_item(struct sfp_statistics_item *item, uint16_t divisor, int is_signed)
 {
-  item->sum -= item->buffer[item->index];
-  item->buffer[item->index] = value;
-  item->sum += value;
+  item->divisor = divisor;
+  item->is_signed = is_signed;
+  item->trend_slope = NAN;
+}
+
+static inline size_t sorted_lower_bound(int32_t *sorted, size_t count, int32_t value)
+{
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (sorted[middle] < value) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+static inline void sorted_replace(int32_t *sorted, size_t count, int32_t old_value, int32_t new_value)
+{
+  // Remove the evicted value and insert the new one with a single move of the
+  // elements in between.
+  size_t old_position = sorted_lower_bound(sorted, count, old_value);
+  size_t new_position = sorted_lower_bound(sorted, count, new_value);
+
+  if (new_position > old_position) {
+    new_position--;
+    memmove(&sorted[old_position], &sorted[old_position + 1], (new_position - old_position) * sizeof(int32_t));
+  } else {
+    memmove(&sorted[new_position + 1], &sorted[new_position], (old_position - new_position) * sizeof(int32_t));
+  }
+  sorted[new_position] = new_value;
+}
+
+static inline void sorted_insert(int32_t *sorted, size_t count, int32_t value)
+{
+  size_t position = sorted_lower_bound(sorted, count, value);
+  memmove(&sorted[position + 1], &sorted[position], (count - position) * sizeof(int32_t));
+  sorted[position] = value;
+}
+
+static inline int32_t statistics_value(struct sfp_statistics_item *item, uint16_t raw)
+{
+  return item->is_signed ? (int16_t) raw : raw;
+}
+
+static inline double ewma_decay(size_t samples)
+{
+  // Computes (1 - alpha)^samples by repeated squaring.
+  double base = 1.0 - SFP_STATISTICS_EWMA_ALPHA;
+  double result = 1.0;
+  while (samples) {
+    if (samples & 1) {
+      result *= base;
+    }
+    base *= base;
+    samples >>= 1;
+  }
+
+  return result;
+}
+
+static inline uint16_t statistics_last(struct sfp_statistics_item *item)
+{
+  return item->buffer[(item->index + SFP_STATISTICS_BUFFER_SIZE - 1) % SFP_STATISTICS_BUFFER_SIZE];
+}
+
+static inline double statistics_ewma(struct sfp_statistics_item *item)
+{
+  // Account for pending repeats without applying them to the window.
+  if (!item->repeats) {
+    return item->raw_ewma;
+  }
+
+  int32_t value = statistics_value(item, statistics_last(item));
+  return value + (item->raw_ewma - value) * ewma_decay(item->repeats);
+}
+
+static inline void statistics_push(struct sfp_statistics_item *item, uint16_t raw)
+{
+  int32_t value = statistics_value(item, raw);
 
   if (item->samples < SFP_STATISTICS_BUFFER_SIZE) {
+    sorted_insert(item->sorted, item->samples, value);
     item->samples++;
+  } else {
+    int32_t old_value = statistics_value(item, item->buffer[item->index]);
+    sorted_replace(item->sorted, item->samples, old_value, value);
+    item->sum -= old_value;
+    item->sum_squares -= (int64_t) old_value * old_value;
   }
+  item->sum += value;
+  item->sum_squares += (int64_t) value * value;
+
+  item->buffer[item->index] = raw;
   item->index = (item->index + 1) % SFP_STATISTICS_BUFFER_SIZE;
+}
+
+static inline void statistics_flush(struct sfp_statistics_item *item)
+{
+  size_t repeats = item->repeats;
+  if (!repeats) {
+    return;
+  }
+
+  item->raw_ewma = statistics_ewma(item);
+  item->repeats = 0;
+
+  uint16_t raw = statistics_last(item);
+  int32_t value = statistics_value(item, raw);
+
+  if (repeats < SFP_STATISTICS_BUFFER_SIZE) {
+    while (repeats--) {
+      statistics_push(item, raw);
+    }
+    return;
+  }
+
+  // The whole window now consists of the repeated sample.
+  int64_t n = SFP_STATISTICS_BUFFER_SIZE;
+  for (size_t index = 0; index < SFP_STATISTICS_BUFFER_SIZE; index++) {
+    item->buffer[index] = raw;
+    item->sorted[index] = value;
+  }
+  item->samples = SFP_STATISTICS_BUFFER_SIZE;
+  item->index = (item->index + repeats) % SFP_STATISTICS_BUFFER_SIZE;
+  item->sum = n * value;
+  item->sum_squares = n * value * value;
+}
+
+void sfp_update_module_statistics_item(struct sfp_statistics_item *item, uint16_t raw)
+{
+  statistics_flush(item);
+
+  int32_t value = statistics_value(item, raw);
+  if (item->samples == 0) {
+    item->raw_ewma = value;
+  } else {
+    item->raw_ewma += SFP_STATISTICS_EWMA_ALPHA * (value - item->raw_ewma);
+  }
+
+  statistics_push(item, raw);
+}
 
-  item->average = item->sum / (float) item->samples;
+void sfp_repeat_module_statistics_item(struct sfp_statistics_item *item)
+{
+  // Repeats are only applied to the window once they are needed.
+  if (item->samples > 0) {
+    item->repeats++;
+  }
+}
 
-  // Invalidate statistics computed on-demand.
-  item->variance = NAN;
-  item->minimum = INFINITY;
-  item->maximum = -INFINITY;
+static inline float sorted_percentile(struct sfp_statistics_item *item, unsigned int percent)
+{
+  // Nearest-rank method.
+  size_t rank = (percent * item->samples + 99) / 100;
+  return item->sorted[rank > 0 ? rank - 1 : 0] / (float) item->divisor;
 }
 
 void sfp_compute_module_statistics_item(struct sfp_statistics_item *item)
 {
-  item->variance = 0;
-  item->minimum = INFINITY;
-  item->maximum = -INFINITY;
+  statistics_flush(item);
+
+  if (!item->samples) {
+    item->average = NAN;
+    item->variance = NAN;
+    item->minimum = INFINITY;
+    item->maximum = -INFINITY;
+    item->ewma = NAN;
+    item->p50 = NAN;
+    item->p95 = NAN;
+    item->p99 = NAN;
+    return;
+  }
+
+  double n = (double) item->samples;
+  double divisor = (double) item->divisor;
+  item->average = item->sum / n / divisor;
+  item->variance = (n * item->sum_squares - (double) item->sum * item->sum) / (n * n) / (divisor * divisor);
+  item->minimum = item->sorted[0] / divisor;
+  item->maximum = item->sorted[item->samples - 1] / divisor;
+  item->ewma = item->raw_ewma / divisor;
+  item->p50 = sorted_percentile(item, 50);
+  item->p95 = sorted_percentile(item, 95);
+  item->p99 = sorted_percentile(item, 99);
+}
+
+void sfp_update_module_statistics_trend(struct sfp_statistics_item *item, uint32_t *times,
+                                        size_t points, size_t index)
+{
+  item->trend[index] = statistics_ewma(item);
+  if (points < SFP_TREND_MIN_POINTS) {
+    item->trend_slope = NAN;
+    return;
+  }
+
+  // Least squares slope over the trend points. Points are only added once per
+  // trend interval, so the fit is simply redone. Times are taken relative to
+  // the newest point to keep the sums well conditioned.
+  double n = (double) points;
+  double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  for (size_t i = 0; i < points; i++) {
+    double x = (int32_t) (times[i] - times[index]);
+    double y = item->trend[i];
+    sum_x += x;
+    sum_y += y;
+    sum_xx += x * x;
+    sum_xy += x * y;
+  }
 
-  for (size_t index = 0; index < item->samples; index++) {
-    float value = item->buffer[index];
-    if (value > item->maximum) {
-      item->maximum = value;
+  double denominator = n * sum_xx - sum_x * sum_x;
+  item->trend_slope = 0;
+  if (denominator > 0) {
+    item->trend_slope = (n * sum_xy - sum_x * sum_y) / denominator / item->divisor;
+  }
+}
+
+static inline float time_to_threshold(float level, float slope, float lower, float upper)
+{
+  // Thresholds are not known before they are first read, and some modules do
+  // not program them at all.
+  if (lower >= upper) {
+    return NAN;
+  } else if (level >= upper || level <= lower) {
+    return 0;
+  } else if (slope > 0) {
+    return (upper - level) / slope;
+  } else if (slope < 0) {
+    return (lower - level) / slope;
+  }
+
+  return INFINITY;
+}
+
+void sfp_compute_module_statistics_trend(struct sfp_statistics_item *item,
+                                         float warning_lower, float warning_upper,
+                                         float error_lower, float error_upper)
+{
+  if (!item->samples || isnan(item->trend_slope)) {
+    item->slope = NAN;
+    item->time_to_warning = NAN;
+    item->time_to_error = NAN;
+    return;
+  }
+
+  item->slope = item->trend_slope;
+
+  item->time_to_warning = time_to_threshold(item->ewma, item->slope, warning_lower, warning_upper);
+  item->time_to_error = time_to_threshold(item->ewma, item->slope, error_lower, error_upper);
+}
+
+uint32_t sfp_decode_module_flags(uint8_t *buffer)
+{
+  uint32_t flags = 0;
+  for (unsigned int flag = 0; flag < __SFP_FLAG_MAX; flag++) {
+    if (buffer[sfp_flags[flag].offset] & sfp_flags[flag].mask) {
+      flags |= 1 << flag;
     }
-    if (value < item->minimum) {
-      item->minimum = value;
+  }
+
+  return flags;
+}
+
+void sfp_update_module_flags(struct sfp_module *module, uint32_t flags)
+{
+  uint32_t changed = module->flags ^ flags;
+  module->flags = flags;
+
+  for (unsigned int flag = 0; changed; flag++, changed >>= 1) {
+    if (changed & 1) {
+      sfp_log_event(module, flag, (flags >> flag) & 1);
     }
-    item->variance += (value - item->average) * (value - item->average);
   }
+}
+
+static inline uint64_t sfp_timestamp()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-  item->variance /= (float) item->samples;
+void sfp_log_event(struct sfp_module *module, unsigned int flag, int state)
+{
+  struct sfp_event *event = &event_log[event_sequence % SFP_EVENT_BUFFER_SIZE];
+  event->sequence = event_sequence++;
+  event->timestamp = sfp_timestamp();
+  snprintf(event->serial_number, sizeof(event->serial_number), "%s", module->serial_number);
+  event->flag = flag;
+  event->state = state;
 }
 
-int sfp_update_module_diagnostics(struct sfp_module *module)
+int sfp_read_module_diagnostics(struct sfp_module *module)
 {
   int i2c_bus = i2c_open(module->bus, SFP_I2C_DIAG_ADDRESS);
   if (i2c_bus < 0) {
     syslog(LOG_ERR, "Failed to read diagnostic data from module on bus '%s'.", module->bus);
+    counters.diagnostics_errors++;
+    sfp_complete_module_diagnostics_requests(module, -1);
     return -1;
   }
 
+  // Only the measurement block is read here, thresholds are refreshed separately.
+  // Buffer offsets match the diagnostics memory map.
   uint8_t buffer[256];
-  if (i2c_read_data(i2c_bus, buffer, sizeof(buffer)) <= 0) {
+  if (i2c_read_data(i2c_bus, SFP_DIAG_MEASUREMENT_OFFSET, &buffer[SFP_DIAG_MEASUREMENT_OFFSET],
+                    SFP_DIAG_MEASUREMENT_LENGTH) < SFP_DIAG_MEASUREMENT_LENGTH) {
     syslog(LOG_ERR, "Failed to read diagnostic data from module on bus '%s'.", module->bus);
     i2c_close(i2c_bus);
+    counters.diagnostics_errors++;
+    sfp_complete_module_diagnostics_requests(module, -1);
     return -1;
   }
 
-  sfp_update_module_diagnostics_item(&module->diagnostics.value, &buffer[SFP_DIAG_VALUE_OFFSET], SFP_DIAG_VALUE_STRIDE);
-  sfp_update_module_diagnostics_item(&module->diagnostics.error_upper, &buffer[SFP_DIAG_ERROR_UP_OFFSET], SFP_DIAG_ERROR_UP_STRIDE);
-  sfp_update_module_diagnostics_item(&module->diagnostics.error_lower, &buffer[SFP_DIAG_ERROR_LO_OFFSET], SFP_DIAG_ERROR_LO_STRIDE);
-  sfp_update_module_diagnostics_item(&module->diagnostics.warning_upper, &buffer[SFP_DIAG_WARNING_UP_OFFSET], SFP_DIAG_WARNING_UP_STRIDE);
-  sfp_update_module_diagnostics_item(&module->diagnostics.warning_lower, &buffer[SFP_DIAG_WARNING_LO_OFFSET], SFP_DIAG_WARNING_LO_STRIDE);
+  counters.diagnostics_reads++;
 
-  // Update running statistics.
-  struct sfp_diagnostics_item *value = &module->diagnostics.value;
-  sfp_update_module_statistics_item(&module->statistics.temperature, value->temperature);
-  sfp_update_module_statistics_item(&module->statistics.vcc, value->vcc);
-  sfp_update_module_statistics_item(&module->statistics.tx_bias, value->tx_bias);
-  sfp_update_module_statistics_item(&module->statistics.tx_power, value->tx_power);
-  sfp_update_module_statistics_item(&module->statistics.rx_power, value->rx_power);
+  // Update status, alarm and warning flags.
+  sfp_update_module_flags(module, sfp_decode_module_flags(buffer));
+
+  // Measurements are only decoded when they change.
+  uint8_t *values = &buffer[SFP_DIAG_VALUE_OFFSET];
+  if (!module->diagnostics_valid || memcmp(module->raw_values, values, SFP_DIAG_VALUE_LENGTH) != 0) {
+    memcpy(module->raw_values, values, SFP_DIAG_VALUE_LENGTH);
+    sfp_update_module_diagnostics_item(&module->diagnostics.value, values, SFP_DIAG_VALUE_STRIDE);
+  }
+
+  module->diagnostics_valid = 1;
+  module->diagnostics_timestamp = sfp_timestamp();
 
   i2c_close(i2c_bus);
+  sfp_complete_module_diagnostics_requests(module, 0);
+  return 0;
+}
+
+int sfp_update_module_diagnostics(struct sfp_module *module)
+{
+  if (sfp_read_module_diagnostics(module) != 0) {
+    return -1;
+  }
+
+  // Update running statistics. On a stable link measurements remain the same
+  // for long periods, in which case only a repeat of the last sample is recorded.
+  uint8_t *values = module->raw_values;
+  struct sfp_statistics *statistics = &module->statistics;
+  if (module->samples_valid && memcmp(module->raw_samples, values, SFP_DIAG_VALUE_LENGTH) == 0) {
+    counters.diagnostics_unchanged++;
+    sfp_repeat_module_statistics_item(&statistics->temperature);
+    sfp_repeat_module_statistics_item(&statistics->vcc);
+    sfp_repeat_module_statistics_item(&statistics->tx_bias);
+    sfp_repeat_module_statistics_item(&statistics->tx_power);
+    sfp_repeat_module_statistics_item(&statistics->rx_power);
+  } else {
+    memcpy(module->raw_samples, values, SFP_DIAG_VALUE_LENGTH);
+    module->samples_valid = 1;
+    sfp_update_module_statistics_item(&statistics->temperature, convert_raw(&values[0]));
+    sfp_update_module_statistics_item(&statistics->vcc, convert_raw(&values[SFP_DIAG_VALUE_STRIDE]));
+    sfp_update_module_statistics_item(&statistics->tx_bias, convert_raw(&values[2 * SFP_DIAG_VALUE_STRIDE]));
+    sfp_update_module_statistics_item(&statistics->tx_power, convert_raw(&values[3 * SFP_DIAG_VALUE_STRIDE]));
+    sfp_update_module_statistics_item(&statistics->rx_power, convert_raw(&values[4 * SFP_DIAG_VALUE_STRIDE]));
+  }
+
+  module->sample_timestamps[module->sample_index] = module->diagnostics_timestamp;
+  module->sample_index = (module->sample_index + 1) % SFP_STATISTICS_BUFFER_SIZE;
+
+  // Sample the long-term trend.
+  uint64_t now = sfp_monotonic_time();
+  if (now >= module->trend_deadline) {
+    module->trend_deadline = now + SFP_TREND_INTERVAL;
+    sfp_update_module_trend(module);
+  }
+
+  return 0;
+}
+
+void sfp_update_module_trend(struct sfp_module *module)
+{
+  // All metrics are sampled together, so they share the trend times.
+  size_t index = module->trend_index;
+  module->trend_time[index] = sfp_monotonic_time() / 1000;
+  module->trend_index = (index + 1) % SFP_TREND_BUFFER_SIZE;
+  if (module->trend_points < SFP_TREND_BUFFER_SIZE) {
+    module->trend_points++;
+  }
+
+  struct sfp_statistics *statistics = &module->statistics;
+  uint32_t *times = module->trend_time;
+  size_t points = module->trend_points;
+  sfp_update_module_statistics_trend(&statistics->temperature, times, points, index);
+  sfp_update_module_statistics_trend(&statistics->vcc, times, points, index);
+  sfp_update_module_statistics_trend(&statistics->tx_bias, times, points, index);
+  sfp_update_module_statistics_trend(&statistics->tx_power, times, points, index);
+  sfp_update_module_statistics_trend(&statistics->rx_power, times, points, index);
+}
+
+int sfp_update_module_thresholds(struct sfp_module *module)
+{
+  int i2c_bus = i2c_open(module->bus, SFP_I2C_DIAG_ADDRESS);
+  if (i2c_bus < 0) {
+    syslog(LOG_ERR, "Failed to read thresholds from module on bus '%s'.", module->bus);
+    return -1;
+  }
+
+  uint8_t buffer[SFP_DIAG_THRESHOLD_LENGTH];
+  if (i2c_read_data(i2c_bus, SFP_DIAG_THRESHOLD_OFFSET, buffer, sizeof(buffer)) < (int) sizeof(buffer)) {
+    syslog(LOG_ERR, "Failed to read thresholds from module on bus '%s'.", module->bus);
+    i2c_close(i2c_bus);
+    return -1;
+  }
+
+  i2c_close(i2c_bus);
+  counters.threshold_refreshes++;
+
+  // Thresholds rarely change, so only decode them when they do.
+  if (memcmp(module->raw_thresholds, buffer, SFP_DIAG_THRESHOLD_LENGTH) != 0) {
+    memcpy(module->raw_thresholds, buffer, SFP_DIAG_THRESHOLD_LENGTH);
+    sfp_update_module_diagnostics_item(&module->diagnostics.error_upper, &buffer[SFP_DIAG_ERROR_UP_OFFSET], SFP_DIAG_ERROR_UP_STRIDE);
+    sfp_update_module_diagnostics_item(&module->diagnostics.error_lower, &buffer[SFP_DIAG_ERROR_LO_OFFSET], SFP_DIAG_ERROR_LO_STRIDE);
+    sfp_update_module_diagnostics_item(&module->diagnostics.warning_upper, &buffer[SFP_DIAG_WARNING_UP_OFFSET], SFP_DIAG_WARNING_UP_STRIDE);
+    sfp_update_module_diagnostics_item(&module->diagnostics.warning_lower, &buffer[SFP_DIAG_WARNING_LO_OFFSET], SFP_DIAG_WARNING_LO_STRIDE);
+  }
+
   return 0;
 }
 
@@ -316,6 +1021,23 @@ int sfp_update_module_statistics(struct sfp_module *module)
   sfp_compute_module_statistics_item(&module->statistics.tx_bias);
   sfp_compute_module_statistics_item(&module->statistics.tx_power);
   sfp_compute_module_statistics_item(&module->statistics.rx_power);
+
+  struct sfp_diagnostics *d = &module->diagnostics;
+  sfp_compute_module_statistics_trend(&module->statistics.temperature,
+    d->warning_lower.temperature, d->warning_upper.temperature,
+    d->error_lower.temperature, d->error_upper.temperature);
+  sfp_compute_module_statistics_trend(&module->statistics.vcc,
+    d->warning_lower.vcc, d->warning_upper.vcc,
+    d->error_lower.vcc, d->error_upper.vcc);
+  sfp_compute_module_statistics_trend(&module->statistics.tx_bias,
+    d->warning_lower.tx_bias, d->warning_upper.tx_bias,
+    d->error_lower.tx_bias, d->error_upper.tx_bias);
+  sfp_compute_module_statistics_trend(&module->statistics.tx_power,
+    d->warning_lower.tx_power, d->warning_upper.tx_power,
+    d->error_lower.tx_power, d->error_upper.tx_power);
+  sfp_compute_module_statistics_trend(&module->statistics.rx_power,
+    d->warning_lower.rx_power, d->warning_upper.rx_power,
+    d->error_lower.rx_power, d->error_upper.rx_power);
   return 0;
 }
 
@@ -348,16 +1070,16 @@ int i2c_open(const char *bus, int address)
   return i2c_bus;
 }
 
-int i2c_read_data(int i2c_bus, uint8_t *data, size_t size)
+int i2c_read_data(int i2c_bus, uint8_t offset, uint8_t *data, size_t size)
 {
-  char buffer[1] = {0x00};
+  char buffer[1] = {offset};
 
   if (write(i2c_bus, buffer, 1) != 1) {
     return 0;
   }
 
   size_t bytes = 0;
-  for (; bytes <= 255 && bytes < size; bytes++){
+  for (; offset + bytes <= 255 && bytes < size; bytes++){
     if (read(i2c_bus, buffer, 1) != 1) {
       break;
     }
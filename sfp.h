@@ -20,25 +20,110 @@
 #define SFP_DRIVER_SFP_H
 
 #include <libubox/avl.h>
+#include <libubox/uloop.h>
 #include <uci.h>
 
 // SFP module autodiscovery interval (in milliseconds).
 #define SFP_AUTODISCOVERY_INTERVAL 10000
+// Maximum autodiscovery interval for buses which remain empty (in milliseconds).
+#define SFP_AUTODISCOVERY_INTERVAL_MAX 80000
+// SFP module threshold refresh interval (in milliseconds).
+#define SFP_THRESHOLD_INTERVAL 10000
 // SFP module diagnostic update interval (in milliseconds).
 #define SFP_UPDATE_INTERVAL 100
 // SFP statistics window size (in number of samples).
 #define SFP_STATISTICS_BUFFER_SIZE 600
+// SFP statistics EWMA smoothing factor (weight of each new sample).
+#define SFP_STATISTICS_EWMA_ALPHA 0.01
+// SFP trend sampling interval (in milliseconds) and number of trend points kept.
+#define SFP_TREND_INTERVAL 60000
+#define SFP_TREND_BUFFER_SIZE 1440
+// Minimum number of trend points before a trend is reported.
+#define SFP_TREND_MIN_POINTS 10
+// SFP event log size (in number of events).
+#define SFP_EVENT_BUFFER_SIZE 256
+
+// Maximum length of a module serial number.
+#define SFP_SERIAL_NUMBER_LENGTH 16
+
+// Length of raw measurement and threshold blocks in diagnostics memory.
+#define SFP_DIAG_VALUE_LENGTH 10
+#define SFP_DIAG_THRESHOLD_LENGTH 40
+
+// SFP module status, alarm and warning flags.
+enum {
+  SFP_FLAG_TX_FAULT,
+  SFP_FLAG_RX_LOS,
+  SFP_FLAG_TEMPERATURE_HIGH_ALARM,
+  SFP_FLAG_TEMPERATURE_LOW_ALARM,
+  SFP_FLAG_VCC_HIGH_ALARM,
+  SFP_FLAG_VCC_LOW_ALARM,
+  SFP_FLAG_TX_BIAS_HIGH_ALARM,
+  SFP_FLAG_TX_BIAS_LOW_ALARM,
+  SFP_FLAG_TX_POWER_HIGH_ALARM,
+  SFP_FLAG_TX_POWER_LOW_ALARM,
+  SFP_FLAG_RX_POWER_HIGH_ALARM,
+  SFP_FLAG_RX_POWER_LOW_ALARM,
+  SFP_FLAG_TEMPERATURE_HIGH_WARNING,
+  SFP_FLAG_TEMPERATURE_LOW_WARNING,
+  SFP_FLAG_VCC_HIGH_WARNING,
+  SFP_FLAG_VCC_LOW_WARNING,
+  SFP_FLAG_TX_BIAS_HIGH_WARNING,
+  SFP_FLAG_TX_BIAS_LOW_WARNING,
+  SFP_FLAG_TX_POWER_HIGH_WARNING,
+  SFP_FLAG_TX_POWER_LOW_WARNING,
+  SFP_FLAG_RX_POWER_HIGH_WARNING,
+  SFP_FLAG_RX_POWER_LOW_WARNING,
+  __SFP_FLAG_MAX,
+};
 
 struct sfp_statistics_item {
-  float sum;
+  // Conversion of raw samples into values.
+  uint16_t divisor;
+  int is_signed;
+
   float average;
   float variance;
   float maximum;
   float minimum;
 
-  float buffer[SFP_STATISTICS_BUFFER_SIZE];
+  // Trend estimation. The EWMA is sampled once per SFP_TREND_INTERVAL and the
+  // slope is computed by linear regression over these points (up to a day),
+  // so that slow degradation is not lost in measurement noise. It is expressed
+  // in units per second and is not available until SFP_TREND_MIN_POINTS points
+  // have been taken. Time to threshold is the estimated number of seconds until
+  // the EWMA crosses the respective warning/error threshold (zero if already
+  // crossed, infinite if the metric is not moving towards any threshold).
+  float ewma;
+  float slope;
+  float time_to_warning;
+  float time_to_error;
+
+  // Percentiles, computed from the sorted copy of the window.
+  float p50;
+  float p95;
+  float p99;
+
+  // Running sums over the window. As they are computed from raw samples,
+  // they are exact and do not accumulate rounding errors.
+  int64_t sum;
+  int64_t sum_squares;
+  double raw_ewma;
+
+  // Raw samples as read from the module.
+  uint16_t buffer[SFP_STATISTICS_BUFFER_SIZE];
+  // Window samples kept in ascending order, maintained on every update.
+  int32_t sorted[SFP_STATISTICS_BUFFER_SIZE];
   size_t samples;
   size_t index;
+  // Number of repeats of the last sample not yet applied to the window.
+  size_t repeats;
+
+  // Raw EWMA trend points, at the same positions as the module's trend times.
+  float trend[SFP_TREND_BUFFER_SIZE];
+  // Slope fitted over the trend points (in units per second, NaN while there
+  // are too few points).
+  double trend_slope;
 };
 
 struct sfp_diagnostics_item {
@@ -65,6 +150,49 @@ struct sfp_statistics {
   struct sfp_statistics_item rx_power;
 };
 
+struct sfp_event {
+  // Sequence number, usable as a cursor into the event log.
+  uint32_t sequence;
+  // Time of the transition (in milliseconds since epoch).
+  uint64_t timestamp;
+
+  // Serial number of the module. A copy is kept as events outlive modules.
+  char serial_number[SFP_SERIAL_NUMBER_LENGTH + 1];
+  unsigned int flag;
+  int state;
+};
+
+struct sfp_counters {
+  // Number of successful and failed diagnostics reads.
+  uint64_t diagnostics_reads;
+  uint64_t diagnostics_errors;
+  // Number of diagnostics reads with unchanged measurements.
+  uint64_t diagnostics_unchanged;
+  // Number of diagnostics update ticks and how late they were (in milliseconds).
+  uint64_t diagnostics_ticks;
+  uint64_t diagnostics_jitter_total;
+  uint32_t diagnostics_jitter_last;
+  uint32_t diagnostics_jitter_max;
+  // Number of threshold refreshes.
+  uint64_t threshold_refreshes;
+  // Number of presence probes on unclaimed buses.
+  uint64_t discovery_probes;
+};
+
+struct sfp_module;
+struct sfp_diagnostics_request;
+
+typedef void (*sfp_diagnostics_request_cb)(struct sfp_diagnostics_request *request,
+                                           struct sfp_module *module,
+                                           int status);
+
+struct sfp_diagnostics_request {
+  // Called once diagnostics have been freshly read from the module.
+  sfp_diagnostics_request_cb cb;
+
+  struct list_head list;
+};
+
 struct sfp_module {
   char *bus;
   char *manufacturer;
@@ -81,6 +209,35 @@ struct sfp_module {
 
   struct sfp_diagnostics diagnostics;
   struct sfp_statistics statistics;
+  // Currently raised flags (bitset of SFP_FLAG_* values).
+  uint32_t flags;
+
+  // Raw diagnostics from the last read, used to detect changes.
+  uint8_t raw_values[SFP_DIAG_VALUE_LENGTH];
+  uint8_t raw_thresholds[SFP_DIAG_THRESHOLD_LENGTH];
+  int diagnostics_valid;
+  // Time of the last successful diagnostics read (in milliseconds since epoch).
+  uint64_t diagnostics_timestamp;
+  // Raw measurements last sampled into statistics.
+  uint8_t raw_samples[SFP_DIAG_VALUE_LENGTH];
+  int samples_valid;
+  // Time of each sample in the statistics windows (in milliseconds since epoch).
+  // All windows are sampled together, so times are kept at the same positions
+  // as the samples in the windows.
+  uint64_t sample_timestamps[SFP_STATISTICS_BUFFER_SIZE];
+  size_t sample_index;
+  // Time when the next trend point is due (monotonic, in milliseconds).
+  uint64_t trend_deadline;
+  // Times of the trend points, shared by all metrics (monotonic, in seconds).
+  uint32_t trend_time[SFP_TREND_BUFFER_SIZE];
+  size_t trend_points;
+  size_t trend_index;
+
+  // Pending requests for fresh diagnostics, served by a single read. Such reads
+  // only refresh current values and flags, statistics are only sampled by the
+  // periodic diagnostics update.
+  struct list_head diagnostics_requests;
+  struct uloop_timeout timer_diagnostics_requests;
 
   // Module registry AVL tree node.
   struct avl_node avl;
@@ -88,6 +245,11 @@ struct sfp_module {
 
 int sfp_init(struct uci_context *uci);
 int sfp_update_module_statistics(struct sfp_module *module);
+void sfp_request_module_diagnostics(struct sfp_module *module, struct sfp_diagnostics_request *request);
 struct avl_tree *sfp_get_modules();
+struct sfp_counters *sfp_get_counters();
+const char *sfp_get_flag_name(unsigned int flag);
+uint32_t sfp_get_event_sequence();
+struct sfp_event *sfp_get_event(uint32_t sequence);
 
 #endif
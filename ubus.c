@@ -18,6 +18,7 @@
  */
 #include "ubus.h"
 #include "sfp.h"
+#include "history.h"
 
 #include <libubox/blobmsg.h>
 
@@ -34,6 +35,36 @@ static const struct blobmsg_policy sfp_module_policy[__SFP_D_MAX] = {
   [SFP_D_MODULE] = { .name = "module", .type = BLOBMSG_TYPE_STRING },
 };
 
+enum {
+  SFP_F_MODULE,
+  SFP_F_FRESH,
+  __SFP_F_MAX,
+};
+
+static const struct blobmsg_policy sfp_diagnostics_policy[__SFP_F_MAX] = {
+  [SFP_F_MODULE] = { .name = "module", .type = BLOBMSG_TYPE_STRING },
+  [SFP_F_FRESH] = { .name = "fresh", .type = BLOBMSG_TYPE_BOOL },
+};
+
+// Deferred ubus request waiting for fresh diagnostics.
+struct ubus_diagnostics_request {
+  struct sfp_diagnostics_request request;
+  struct ubus_context *ctx;
+  struct ubus_request_data req;
+};
+
+enum {
+  SFP_E_MODULE,
+  SFP_E_CURSOR,
+  __SFP_E_MAX,
+};
+
+static const struct blobmsg_policy sfp_events_policy[__SFP_E_MAX] = {
+  [SFP_E_MODULE] = { .name = "module", .type = BLOBMSG_TYPE_STRING },
+  // Cursor may arrive as either integer type, see ubus_get_events.
+  [SFP_E_CURSOR] = { .name = "cursor", .type = BLOBMSG_TYPE_UNSPEC },
+};
+
 static inline void blobmsg_add_sfp_module_info(struct blob_buf *buffer, struct sfp_module *module)
 {
   blobmsg_add_string(buffer, "bus", module->bus);
@@ -53,6 +84,14 @@ static inline void blobmsg_add_float(struct blob_buf *buffer, const char *name,
   blobmsg_add_string(buffer, name, tmp);
 }
 
+static inline void blobmsg_add_float_significant(struct blob_buf *buffer, const char *name, float value)
+{
+  // For values too small for a fixed number of decimals, such as rates.
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "%.6g", value);
+  blobmsg_add_string(buffer, name, tmp);
+}
+
 static inline void blobmsg_add_sfp_module_diagnostics_item(struct blob_buf *buffer,
                                                            const char *name,
                                                            struct sfp_diagnostics_item *item)
@@ -76,6 +115,22 @@ static inline void blobmsg_add_sfp_module_statistics_item(struct blob_buf *buffe
   blobmsg_add_float(buffer, "variance", item->variance);
   blobmsg_add_float(buffer, "minimum", item->minimum);
   blobmsg_add_float(buffer, "maximum", item->maximum);
+  blobmsg_add_float(buffer, "p50", item->p50);
+  blobmsg_add_float(buffer, "p95", item->p95);
+  blobmsg_add_float(buffer, "p99", item->p99);
+  blobmsg_add_float(buffer, "ewma", item->ewma);
+  blobmsg_add_float_significant(buffer, "slope", item->slope);
+  blobmsg_add_float(buffer, "time_to_warning", item->time_to_warning);
+  blobmsg_add_float(buffer, "time_to_error", item->time_to_error);
+  blobmsg_close_table(buffer, c);
+}
+
+static inline void blobmsg_add_sfp_module_flags(struct blob_buf *buffer, struct sfp_module *module)
+{
+  void *c = blobmsg_open_table(buffer, "flags");
+  for (unsigned int flag = 0; flag < __SFP_FLAG_MAX; flag++) {
+    blobmsg_add_u8(buffer, sfp_get_flag_name(flag), (module->flags >> flag) & 1);
+  }
   blobmsg_close_table(buffer, c);
 }
 
@@ -86,6 +141,7 @@ static inline void blobmsg_add_sfp_module_diagnostics(struct blob_buf *buffer, s
   blobmsg_add_sfp_module_diagnostics_item(buffer, "error_lower", &module->diagnostics.error_lower);
   blobmsg_add_sfp_module_diagnostics_item(buffer, "warning_upper", &module->diagnostics.warning_upper);
   blobmsg_add_sfp_module_diagnostics_item(buffer, "warning_lower", &module->diagnostics.warning_lower);
+  blobmsg_add_sfp_module_flags(buffer, module);
 }
 
 static inline void blobmsg_add_sfp_module_statistics(struct blob_buf *buffer, struct sfp_module *module)
@@ -150,6 +206,65 @@ static int ubus_get_modules(struct ubus_context *ctx, struct ubus_object *obj,
   return UBUS_STATUS_OK;
 }
 
+static void ubus_complete_diagnostics_request(struct sfp_diagnostics_request *request,
+                                              struct sfp_module *module,
+                                              int status)
+{
+  struct ubus_diagnostics_request *dr = container_of(request, struct ubus_diagnostics_request, request);
+  void *c;
+
+  if (status == 0) {
+    blob_buf_init(&reply_buf, 0);
+    c = blobmsg_open_table(&reply_buf, module->serial_number);
+    blobmsg_add_sfp_module_diagnostics(&reply_buf, module);
+    blobmsg_close_table(&reply_buf, c);
+
+    ubus_send_reply(dr->ctx, &dr->req, reply_buf.head);
+    ubus_complete_deferred_request(dr->ctx, &dr->req, UBUS_STATUS_OK);
+  } else {
+    ubus_complete_deferred_request(dr->ctx, &dr->req, UBUS_STATUS_UNKNOWN_ERROR);
+  }
+
+  free(dr);
+}
+
+static int ubus_get_diagnostics(struct ubus_context *ctx, struct ubus_object *obj,
+                                struct ubus_request_data *req, const char *method,
+                                struct blob_attr *msg)
+{
+  struct blob_attr *tb[__SFP_F_MAX];
+  struct sfp_module *module;
+
+  blobmsg_parse(sfp_diagnostics_policy, __SFP_F_MAX, tb, blob_data(msg), blob_len(msg));
+
+  if (!tb[SFP_F_FRESH] || !blobmsg_get_bool(tb[SFP_F_FRESH])) {
+    return ubus_get_modules(ctx, obj, req, method, msg);
+  }
+
+  // Fresh diagnostics may only be requested for a specific module.
+  if (!tb[SFP_F_MODULE]) {
+    return UBUS_STATUS_INVALID_ARGUMENT;
+  }
+
+  module = avl_find_element(sfp_get_modules(), blobmsg_data(tb[SFP_F_MODULE]), module, avl);
+  if (!module) {
+    return UBUS_STATUS_NOT_FOUND;
+  }
+
+  // Defer the reply until the module has been read.
+  struct ubus_diagnostics_request *dr = calloc(1, sizeof(struct ubus_diagnostics_request));
+  if (!dr) {
+    return UBUS_STATUS_UNKNOWN_ERROR;
+  }
+
+  dr->ctx = ctx;
+  dr->request.cb = ubus_complete_diagnostics_request;
+  ubus_defer_request(ctx, req, &dr->req);
+  sfp_request_module_diagnostics(module, &dr->request);
+
+  return UBUS_STATUS_OK;
+}
+
 static int ubus_get_vendor_specific_data(struct ubus_context *ctx, struct ubus_object *obj,
                                          struct ubus_request_data *req, const char *method,
                                          struct blob_attr *msg)
@@ -179,11 +294,130 @@ static int ubus_get_vendor_specific_data(struct ubus_context *ctx, struct ubus_o
   return UBUS_STATUS_OK;
 }
 
+static int ubus_get_history_binary(struct ubus_context *ctx, struct ubus_object *obj,
+                                   struct ubus_request_data *req, const char *method,
+                                   struct blob_attr *msg)
+{
+  struct blob_attr *tb[__SFP_D_MAX];
+  struct sfp_module *module = NULL;
+
+  blobmsg_parse(sfp_module_policy, __SFP_D_MAX, tb, blob_data(msg), blob_len(msg));
+
+  blob_buf_init(&reply_buf, 0);
+
+  if (tb[SFP_D_MODULE]) {
+    // Filter to a specific module.
+    module = avl_find_element(sfp_get_modules(), blobmsg_data(tb[SFP_D_MODULE]), module, avl);
+    if (!module) {
+      return UBUS_STATUS_NOT_FOUND;
+    }
+  }
+
+  if (strcmp(method, "dump_history_binary") == 0) {
+    ssize_t length = history_dump(module, HISTORY_DUMP_PATH);
+    if (length < 0) {
+      return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+
+    blobmsg_add_string(&reply_buf, "path", HISTORY_DUMP_PATH);
+    blobmsg_add_u32(&reply_buf, "size", length);
+  } else {
+    size_t size = history_get_max_size(module);
+    uint8_t *history = (uint8_t*) malloc(size);
+    if (!history) {
+      return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+
+    ssize_t length = history_encode(module, history, size);
+    if (length < 0) {
+      free(history);
+      return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+
+    blobmsg_add_field(&reply_buf, BLOBMSG_TYPE_UNSPEC, "history", history, length);
+    free(history);
+  }
+
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
+}
+
+static int ubus_get_events(struct ubus_context *ctx, struct ubus_object *obj,
+                           struct ubus_request_data *req, const char *method,
+                           struct blob_attr *msg)
+{
+  struct blob_attr *tb[__SFP_E_MAX];
+  struct sfp_module *module = NULL;
+  uint32_t sequence = sfp_get_event_sequence();
+  uint32_t cursor = 0;
+  uint32_t lost = 0;
+  void *c;
+
+  blobmsg_parse(sfp_events_policy, __SFP_E_MAX, tb, blob_data(msg), blob_len(msg));
+
+  blob_buf_init(&reply_buf, 0);
+
+  if (tb[SFP_E_MODULE]) {
+    // Filter to a specific module.
+    module = avl_find_element(sfp_get_modules(), blobmsg_data(tb[SFP_E_MODULE]), module, avl);
+    if (!module) {
+      return UBUS_STATUS_NOT_FOUND;
+    }
+  }
+
+  if (tb[SFP_E_CURSOR]) {
+    // Sequence numbers are unsigned 32-bit and replied as 64-bit integers, but
+    // conversion from JSON turns any integer which fits into 32 bits into an
+    // INT32, so both types are accepted.
+    uint64_t requested;
+    switch (blobmsg_type(tb[SFP_E_CURSOR])) {
+      case BLOBMSG_TYPE_INT32: requested = blobmsg_get_u32(tb[SFP_E_CURSOR]); break;
+      case BLOBMSG_TYPE_INT64: requested = blobmsg_get_u64(tb[SFP_E_CURSOR]); break;
+      default: return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+    cursor = requested < sequence ? requested : sequence;
+  }
+
+  // Skip events which have already been overwritten.
+  if (sequence - cursor > SFP_EVENT_BUFFER_SIZE) {
+    lost = sequence - SFP_EVENT_BUFFER_SIZE - cursor;
+    cursor = sequence - SFP_EVENT_BUFFER_SIZE;
+  }
+
+  c = blobmsg_open_array(&reply_buf, "events");
+  for (; cursor != sequence; cursor++) {
+    struct sfp_event *event = sfp_get_event(cursor);
+    if (module && strcmp(event->serial_number, module->serial_number) != 0) {
+      continue;
+    }
+
+    void *e = blobmsg_open_table(&reply_buf, NULL);
+    blobmsg_add_u64(&reply_buf, "sequence", event->sequence);
+    blobmsg_add_u64(&reply_buf, "timestamp", event->timestamp);
+    blobmsg_add_string(&reply_buf, "module", event->serial_number);
+    blobmsg_add_string(&reply_buf, "flag", sfp_get_flag_name(event->flag));
+    blobmsg_add_u8(&reply_buf, "state", event->state);
+    blobmsg_close_table(&reply_buf, e);
+  }
+  blobmsg_close_array(&reply_buf, c);
+
+  blobmsg_add_u64(&reply_buf, "cursor", sequence);
+  blobmsg_add_u32(&reply_buf, "lost", lost);
+
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
+}
+
 static const struct ubus_method sfp_methods[] = {
   UBUS_METHOD("get_modules", ubus_get_modules, sfp_module_policy),
-  UBUS_METHOD("get_diagnostics", ubus_get_modules, sfp_module_policy),
+  UBUS_METHOD("get_diagnostics", ubus_get_diagnostics, sfp_diagnostics_policy),
   UBUS_METHOD("get_statistics", ubus_get_modules, sfp_module_policy),
   UBUS_METHOD("get_vendor_specific_data", ubus_get_vendor_specific_data, sfp_module_policy),
+  UBUS_METHOD("get_events", ubus_get_events, sfp_events_policy),
+  UBUS_METHOD("get_history_binary", ubus_get_history_binary, sfp_module_policy),
+  UBUS_METHOD("dump_history_binary", ubus_get_history_binary, sfp_module_policy),
 };
 
 static struct ubus_object_type sfp_type =